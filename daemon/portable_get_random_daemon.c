@@ -0,0 +1,556 @@
+// Copyright 2021 Mathias Panzenböck
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+// the Software, and to permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Fills a shared memory ring with random blocks and passes it read-only to
+// every client connecting to its Unix socket. See src/portable_get_random_shm.h
+// for the protocol. This must be linked against a portable_get_random() that
+// was compiled without PORTABLE_GET_RANDOM_SHM, otherwise it would ask itself.
+
+#if defined(__linux__)
+    // we compile with -std=c99 but here we do want POSIX and BSD APIs and
+    // struct ucred
+    #define _GNU_SOURCE 1
+#elif defined(__APPLE__)
+    #define _DARWIN_C_SOURCE 1
+#endif
+
+#include <portable_get_random.h>
+#include "portable_get_random_shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#if defined(PORTABLE_GET_RANDOM_SHM)
+    #error "The daemon must not be compiled with PORTABLE_GET_RANDOM_SHM."
+#endif
+
+// While clients drain the ring it is refilled right away (only checking for new
+// connections in between) until head stops moving. Then the daemon waits a
+// millisecond for clients to continue, and after that it only wakes up a few
+// times per second.
+#define POLL_TIMEOUT_BUSY_MSEC  1
+#define POLL_TIMEOUT_IDLE_MSEC 100
+
+#define DEFAULT_SOCKET_MODE 0600
+#define MAX_ALLOWED_UIDS    32
+
+static uid_t allowed_uids[MAX_ALLOWED_UIDS];
+static size_t allowed_uid_count = 0;
+
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int signum) {
+    (void)signum;
+    running = 0;
+}
+
+void usage(int argc, char *argv[]) {
+    const char *progname = argc > 0 ? argv[0] : "portable-get-random-daemon";
+    printf("usage: %s [-b block-size] [-n block-count] [-m socket-mode] [-u uid]... [socket-path]\n", progname);
+    printf("\n");
+    printf("Only clients running as root, as the same user as the daemon, or as one of\n");
+    printf("the users given via -u are served. The socket mode (octal, default: %04o)\n", DEFAULT_SOCKET_MODE);
+    printf("must allow those users to connect.\n");
+}
+
+static int parse_size(const char *str, unsigned long long max, unsigned long long *valueptr) {
+    char *endptr = NULL;
+    const unsigned long long value = strtoull(str, &endptr, 10);
+    if (!*str || *endptr || value == 0 || value > max) {
+        return EINVAL;
+    }
+    *valueptr = value;
+    return 0;
+}
+
+// Returns a read-write file descriptor of a new shared memory object of the
+// given size and stores a read-only one for the clients in *ro_fdptr.
+static int create_shm(size_t size, int *ro_fdptr) {
+    char name[64];
+
+    for (int attempt = 0; attempt < 16; ++ attempt) {
+        unsigned int suffix = 0;
+        int errnum = portable_get_random((unsigned char*)&suffix, sizeof(suffix));
+        if (errnum != 0) {
+            errno = errnum;
+            return -1;
+        }
+
+        snprintf(name, sizeof(name), "/portable-get-random-%ld-%08x", (long)getpid(), suffix);
+
+        const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            if (errno == EEXIST) {
+                continue;
+            }
+            return -1;
+        }
+
+        const int ro_fd = shm_open(name, O_RDONLY, 0);
+        errnum = errno;
+
+        // the object lives on as long as the daemon or any client has it mapped
+        shm_unlink(name);
+
+        if (ro_fd < 0) {
+            close(fd);
+            errno = errnum;
+            return -1;
+        }
+
+        if (ftruncate(fd, size) != 0) {
+            errnum = errno;
+            close(ro_fd);
+            close(fd);
+            errno = errnum;
+            return -1;
+        }
+
+        *ro_fdptr = ro_fd;
+        return fd;
+    }
+
+    errno = EEXIST;
+    return -1;
+}
+
+// Creates the object holding head, which clients get read-write. Under Linux
+// its size is sealed, so a client can't shrink it and crash the others with
+// SIGBUS.
+static int create_head(void) {
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+    const int fd = memfd_create("portable-get-random-head", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(PortableGetRandom_ShmHead)) != 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        const int errnum = errno;
+        close(fd);
+        errno = errnum;
+        return -1;
+    }
+
+    return fd;
+#else
+    int ro_fd = -1;
+    const int fd = create_shm(sizeof(PortableGetRandom_ShmHead), &ro_fd);
+    if (fd >= 0) {
+        close(ro_fd);
+    }
+    return fd;
+#endif
+}
+
+// Same check as the client does for the daemon, plus the users given via -u.
+static int client_allowed(int sock) {
+#if defined(__linux__)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        return 0;
+    }
+    const uid_t uid = cred.uid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(sock, &uid, &gid) != 0) {
+        return 0;
+    }
+#endif
+
+    if (uid == 0 || uid == geteuid()) {
+        return 1;
+    }
+
+    for (size_t index = 0; index < allowed_uid_count; ++ index) {
+        if (allowed_uids[index] == uid) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int listen_socket(const char *path, mode_t mode) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    // bind() creates the socket file with 0777 & ~umask, so don't depend on the
+    // caller's umask
+    const mode_t old_umask = umask(~mode & 0777);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        int errnum = errno;
+        if (errnum != EADDRINUSE) {
+            umask(old_umask);
+            close(sock);
+            errno = errnum;
+            return -1;
+        }
+
+        // Only remove the socket file if nobody is listening on it anymore.
+        const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe < 0) {
+            errnum = errno;
+            umask(old_umask);
+            close(sock);
+            errno = errnum;
+            return -1;
+        }
+
+        const int stale = connect(probe, (struct sockaddr*)&addr, sizeof(addr)) != 0 && errno == ECONNREFUSED;
+        close(probe);
+
+        if (!stale || unlink(path) != 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            errnum = stale ? errno : EADDRINUSE;
+            umask(old_umask);
+            close(sock);
+            errno = errnum;
+            return -1;
+        }
+    }
+
+    umask(old_umask);
+
+    if (listen(sock, SOMAXCONN) != 0 || fcntl(sock, F_SETFL, O_NONBLOCK) != 0) {
+        const int errnum = errno;
+        close(sock);
+        unlink(path);
+        errno = errnum;
+        return -1;
+    }
+
+    return sock;
+}
+
+// Sends the read-only ring and the head object in one message.
+static int send_fds(int sock, int ring_fd, int head_fd) {
+    const int fds[2] = { ring_fd, head_fd };
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t count;
+    do {
+        count = sendmsg(sock, &msg, 0);
+    } while (count < 0 && errno == EINTR);
+
+    return count < 0 ? errno : 0;
+}
+
+// Refills every slot whose block was claimed. Contiguous slots are filled with
+// a single call to portable_get_random().
+static int fill(PortableGetRandom_ShmHeader *header, PortableGetRandom_ShmHead *headptr, uint64_t *tailptr) {
+    const uint64_t block_count = header->block_count;
+    const size_t   block_size  = header->block_size;
+    uint64_t *seqs = (uint64_t*)((unsigned char*)header + header->seqs_offset);
+    unsigned char *data = (unsigned char*)header + header->data_offset;
+    const uint64_t head = __atomic_load_n(&headptr->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = *tailptr;
+
+    while (tail - head < block_count) {
+        const uint64_t slot = tail % block_count;
+        uint64_t count = block_count - slot;
+        if (count > block_count - (tail - head)) {
+            count = block_count - (tail - head);
+        }
+
+        const int errnum = portable_get_random(data + slot * block_size, count * block_size);
+        if (errnum != 0) {
+            return errnum;
+        }
+
+        for (uint64_t index = 0; index < count; ++ index) {
+            __atomic_store_n(&seqs[slot + index], tail + index + 1, __ATOMIC_RELEASE);
+        }
+
+        tail += count;
+        *tailptr = tail;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long block_size  = PORTABLE_GET_RANDOM_SHM_BLOCK_SIZE;
+    unsigned long long block_count = PORTABLE_GET_RANDOM_SHM_BLOCK_COUNT;
+    const char *path = NULL;
+    mode_t mode = DEFAULT_SOCKET_MODE;
+    PortableGetRandom_ShmHeader *header = NULL;
+    PortableGetRandom_ShmHead *head = NULL;
+    size_t size = 0;
+    int fd = -1;
+    int ro_fd = -1;
+    int head_fd = -1;
+    int sock = -1;
+    int status = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:n:m:u:h")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (parse_size(optarg, UINT32_MAX, &block_size) != 0) {
+                    fprintf(stderr, "*** error: illegal block size: %s\n", optarg);
+                    goto error;
+                }
+                break;
+
+            case 'n':
+                if (parse_size(optarg, SIZE_MAX / sizeof(uint64_t), &block_count) != 0) {
+                    fprintf(stderr, "*** error: illegal block count: %s\n", optarg);
+                    goto error;
+                }
+                break;
+
+            case 'm':
+            {
+                char *endptr = NULL;
+                const unsigned long value = strtoul(optarg, &endptr, 8);
+                if (!*optarg || *endptr || value > 0777) {
+                    fprintf(stderr, "*** error: illegal socket mode: %s\n", optarg);
+                    goto error;
+                }
+                mode = value;
+                break;
+            }
+
+            case 'u':
+            {
+                unsigned long long uid = 0;
+                if (strcmp(optarg, "0") != 0 && parse_size(optarg, (uid_t)-1, &uid) != 0) {
+                    fprintf(stderr, "*** error: illegal user id: %s\n", optarg);
+                    goto error;
+                }
+                if (allowed_uid_count >= MAX_ALLOWED_UIDS) {
+                    fprintf(stderr, "*** error: too many user ids, at most %d are supported\n", MAX_ALLOWED_UIDS);
+                    goto error;
+                }
+                allowed_uids[allowed_uid_count ++] = uid;
+                break;
+            }
+
+            case 'h':
+                usage(argc, argv);
+                goto cleanup;
+
+            default:
+                usage(argc, argv);
+                goto error;
+        }
+    }
+
+    if (optind + 1 < argc) {
+        usage(argc, argv);
+        goto error;
+    }
+
+    if (optind < argc) {
+        path = argv[optind];
+    } else {
+        path = getenv(PORTABLE_GET_RANDOM_SOCKET_ENV);
+        if (path == NULL || !*path) {
+            path = PORTABLE_GET_RANDOM_SOCKET;
+        }
+    }
+
+    const size_t seqs_offset = sizeof(PortableGetRandom_ShmHeader);
+    const size_t data_offset = (seqs_offset + block_count * sizeof(uint64_t) + PORTABLE_GET_RANDOM_SHM_CACHE_LINE - 1) /
+                               PORTABLE_GET_RANDOM_SHM_CACHE_LINE * PORTABLE_GET_RANDOM_SHM_CACHE_LINE;
+    if (block_count > (SIZE_MAX - data_offset) / block_size) {
+        fprintf(stderr, "*** error: ring too big: %llu blocks of %llu bytes\n", block_count, block_size);
+        goto error;
+    }
+    size = data_offset + block_count * block_size;
+
+    fd = create_shm(size, &ro_fd);
+    if (fd < 0) {
+        fprintf(stderr, "*** error: creating shared memory: %s\n", strerror(errno));
+        goto error;
+    }
+
+    head_fd = create_head();
+    if (head_fd < 0) {
+        fprintf(stderr, "*** error: creating shared memory: %s\n", strerror(errno));
+        goto error;
+    }
+
+    head = mmap(NULL, sizeof(PortableGetRandom_ShmHead), PROT_READ | PROT_WRITE, MAP_SHARED, head_fd, 0);
+    if (head == MAP_FAILED) {
+        head = NULL;
+        fprintf(stderr, "*** error: mmap(%zu): %s\n", sizeof(PortableGetRandom_ShmHead), strerror(errno));
+        goto error;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        header = NULL;
+        fprintf(stderr, "*** error: mmap(%zu): %s\n", size, strerror(errno));
+        goto error;
+    }
+
+    header->magic       = PORTABLE_GET_RANDOM_SHM_MAGIC;
+    header->version     = PORTABLE_GET_RANDOM_SHM_VERSION;
+    header->block_size  = block_size;
+    header->block_count = block_count;
+    header->seqs_offset = seqs_offset;
+    header->data_offset = data_offset;
+    head->head          = 0;
+
+    uint64_t tail = 0;
+    int errnum = fill(header, head, &tail);
+    if (errnum != 0) {
+        fprintf(stderr, "*** error: portable_get_random(): %s\n", strerror(errnum));
+        goto error;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT,  &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    sock = listen_socket(path, mode);
+    if (sock < 0) {
+        fprintf(stderr, "*** error: listening on %s: %s\n", path, strerror(errno));
+        goto error;
+    }
+
+    int timeout = POLL_TIMEOUT_IDLE_MSEC;
+    while (running) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN, .revents = 0 };
+        const int count = poll(&pfd, 1, timeout);
+
+        if (count < 0 && errno != EINTR) {
+            fprintf(stderr, "*** error: poll(): %s\n", strerror(errno));
+            goto error;
+        }
+
+        if (count > 0) {
+            for (;;) {
+                const int client = accept(sock, NULL, NULL);
+                if (client < 0) {
+                    if (errno == ECONNABORTED || errno == EINTR) {
+                        continue;
+                    }
+                    // EAGAIN or e.g. EMFILE, try again in the next iteration
+                    break;
+                }
+
+                if (!client_allowed(client)) {
+                    fprintf(stderr, "*** warning: rejected client running as a different user\n");
+                    close(client);
+                    continue;
+                }
+
+                errnum = send_fds(client, ro_fd, head_fd);
+                if (errnum != 0) {
+                    fprintf(stderr, "*** warning: sending shared memory to client: %s\n", strerror(errnum));
+                }
+                close(client);
+            }
+        }
+
+        const uint64_t old_tail = tail;
+        errnum = fill(header, head, &tail);
+        if (errnum != 0) {
+            fprintf(stderr, "*** error: portable_get_random(): %s\n", strerror(errnum));
+            goto error;
+        }
+
+        timeout = tail != old_tail ? 0 :
+                  timeout == 0     ? POLL_TIMEOUT_BUSY_MSEC :
+                                     POLL_TIMEOUT_IDLE_MSEC;
+    }
+
+    goto cleanup;
+
+error:
+    status = 1;
+
+cleanup:
+    if (sock >= 0) {
+        close(sock);
+        unlink(path);
+    }
+
+    if (header != NULL) {
+        munmap(header, size);
+    }
+
+    if (head != NULL) {
+        munmap(head, sizeof(PortableGetRandom_ShmHead));
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (ro_fd >= 0) {
+        close(ro_fd);
+    }
+
+    if (head_fd >= 0) {
+        close(head_fd);
+    }
+
+    return status;
+}
@@ -0,0 +1,189 @@
+#if defined(__linux__)
+    // we compile with -std=c99 but here we do want clock_gettime() and getrusage()
+    #define _DEFAULT_SOURCE 1
+#endif
+
+#include <portable_get_random.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+    #include <windows.h>
+
+    #if defined(__MINGW32__) || defined(__MINGW64__)
+        #include <inttypes.h>
+    #elif defined(_WIN64)
+        #define PRIuPTR "I64u"
+    #elif defined(_WIN32)
+        #define PRIuPTR "I32u"
+    #endif
+#else
+    #include <inttypes.h>
+    #include <time.h>
+    #include <unistd.h>
+    #include <sys/resource.h>
+#endif
+
+static double now(void) {
+#if defined(_WIN32) || defined(_WIN64)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static size_t page_size(void) {
+#if defined(_WIN32) || defined(_WIN64)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    const long size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? (size_t)size : 4096;
+#endif
+}
+
+// peak resident set size in KiB or -1 if unknown
+static long max_rss(void) {
+#if defined(_WIN32) || defined(_WIN64)
+    return -1;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+    #if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+    #else
+    return usage.ru_maxrss;
+    #endif
+#endif
+}
+
+void usage(int argc, char *argv[]) {
+    const char *progname = argc > 0 ? argv[0] : "bench_random_map";
+    printf("usage: %s <map|fill|eager> <size> [page-stride]\n", progname);
+    printf("\n");
+    printf("Measures time to first byte and the time to read one byte of every\n");
+    printf("page-stride-th page (default: 100) of a random buffer of the given size.\n");
+    printf("map uses portable_get_random_map(), fill uses it too but sets\n");
+    printf("PORTABLE_GET_RANDOM_MAP_EAGER to force its multi-threaded eager fill,\n");
+    printf("eager uses malloc() and portable_get_random().\n");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned char *buffer = NULL;
+    int mapped = 0;
+    int status = 0;
+    size_t size = 0;
+
+    if (argc < 3 || argc > 4) {
+        usage(argc, argv);
+        goto error;
+    }
+
+    if (strcmp(argv[1], "map") == 0) {
+        mapped = 1;
+    } else if (strcmp(argv[1], "fill") == 0) {
+        mapped = 1;
+#if !defined(_WIN32) && !defined(_WIN64)
+        // Windows always fills eagerly
+        setenv("PORTABLE_GET_RANDOM_MAP_EAGER", "1", 1);
+#endif
+    } else if (strcmp(argv[1], "eager") != 0) {
+        fprintf(stderr, "*** error: illegal mode: %s\n", argv[1]);
+        goto error;
+    }
+
+    char *endptr = NULL;
+    const unsigned long long ullsize = strtoull(argv[2], &endptr, 10);
+    if (!*argv[2] || *endptr || ullsize == 0 || ullsize > SIZE_MAX) {
+        fprintf(stderr, "*** error: illegal size: %s\n", argv[2]);
+        goto error;
+    }
+    size = ullsize;
+
+    const size_t page = page_size();
+    size_t stride = 100;
+    if (argc > 3) {
+        const unsigned long long ullstride = strtoull(argv[3], &endptr, 10);
+        if (!*argv[3] || *endptr || ullstride == 0 || ullstride > SIZE_MAX / page) {
+            fprintf(stderr, "*** error: illegal page stride: %s\n", argv[3]);
+            goto error;
+        }
+        stride = ullstride;
+    }
+
+    const long rss_before = max_rss();
+    const double start = now();
+    int errnum;
+
+    if (mapped) {
+        errnum = portable_get_random_map(&buffer, size);
+        if (errnum != 0) {
+            fprintf(stderr, "*** error: portable_get_random_map(&buffer, %" PRIuPTR "): %s\n", size, strerror(errnum));
+            goto error;
+        }
+    } else {
+        buffer = malloc(size);
+        if (buffer == NULL) {
+            fprintf(stderr, "*** error: malloc(%" PRIuPTR "): %s\n", size, strerror(errno));
+            goto error;
+        }
+
+        errnum = portable_get_random(buffer, size);
+        if (errnum != 0) {
+            fprintf(stderr, "*** error: portable_get_random(buffer, %" PRIuPTR "): %s\n", size, strerror(errnum));
+            goto error;
+        }
+    }
+
+    volatile unsigned char sink = buffer[0];
+    const double first_byte = now();
+
+    size_t pages = 0;
+    for (size_t offset = 0; offset < size; offset += stride * page) {
+        sink ^= buffer[offset];
+        ++ pages;
+    }
+    const double sparse = now();
+    (void)sink;
+
+    const long rss_after = max_rss();
+
+    printf("mode:               %s\n", argv[1]);
+    printf("size:               %" PRIuPTR " bytes\n", size);
+    printf("page size:          %" PRIuPTR " bytes\n", page);
+    printf("time to first byte: %.3f ms\n", (first_byte - start) * 1e3);
+    printf("sparse access:      %.3f ms (%" PRIuPTR " pages, every %" PRIuPTR ". page)\n",
+        (sparse - first_byte) * 1e3, pages, stride);
+    printf("total:              %.3f ms\n", (sparse - start) * 1e3);
+    if (rss_before >= 0 && rss_after >= 0) {
+        printf("peak RSS growth:    %ld KiB\n", rss_after - rss_before);
+    }
+
+    goto cleanup;
+
+error:
+    status = 1;
+
+cleanup:
+    if (mapped) {
+        if (buffer != NULL) {
+            portable_get_random_unmap(buffer, size);
+        }
+    } else {
+        free(buffer);
+    }
+
+    return status;
+}
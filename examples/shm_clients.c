@@ -0,0 +1,323 @@
+#if defined(__linux__)
+    // we compile with -std=c99 but here we do want mkdtemp(), setenv() etc.
+    #define _DEFAULT_SOURCE 1
+#elif defined(__APPLE__)
+    #define _DARWIN_C_SOURCE 1
+#endif
+
+#include <portable_get_random.h>
+#include "portable_get_random_shm.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#if !defined(PORTABLE_GET_RANDOM_SHM)
+    #error "This example needs the shared memory client, compile with SHM=ON."
+#endif
+
+// Starts the daemon on a temporary socket, lets many forked clients claim
+// blocks at the same time and checks that no block was handed out twice.
+// Also checks that clients fall back to the normal implementation when no
+// daemon is running.
+
+#define BLOCK_SIZE PORTABLE_GET_RANDOM_SHM_BLOCK_SIZE
+#define DAEMON_START_TIMEOUT_MSEC 5000
+
+void usage(int argc, char *argv[]) {
+    const char *progname = argc > 0 ? argv[0] : "shm_clients";
+    printf("usage: %s <daemon-path> [clients] [blocks-per-client]\n", progname);
+}
+
+static int parse_count(const char *str, size_t *valueptr) {
+    char *endptr = NULL;
+    const unsigned long long value = strtoull(str, &endptr, 10);
+    if (!*str || *endptr || value == 0 || value > 1000000) {
+        return EINVAL;
+    }
+    *valueptr = value;
+    return 0;
+}
+
+static void sleep_msec(long msec) {
+    struct timespec ts = { .tv_sec = msec / 1000, .tv_nsec = (msec % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+// Connects like the client does, but keeps the head object so the ring head
+// can be inspected. Also checks that the ring itself can't be mapped writable.
+// Returns NULL if no daemon answers or the ring is writable.
+static PortableGetRandom_ShmHead *connect_head(const char *path, int *writableptr) {
+    PortableGetRandom_ShmHead *head = NULL;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return NULL;
+    }
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return NULL;
+    }
+
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    if (recvmsg(sock, &msg, 0) > 0) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+            int fds[2];
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+            void *ring = mmap(NULL, sizeof(PortableGetRandom_ShmHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+            if (ring != MAP_FAILED) {
+                munmap(ring, sizeof(PortableGetRandom_ShmHeader));
+                *writableptr = 1;
+            }
+
+            head = mmap(NULL, sizeof(PortableGetRandom_ShmHead), PROT_READ, MAP_SHARED, fds[1], 0);
+            if (head == MAP_FAILED) {
+                head = NULL;
+            }
+            close(fds[0]);
+            close(fds[1]);
+        }
+    }
+
+    close(sock);
+    return head;
+}
+
+// Forks clients that each write blocks_per_client blocks into their part of
+// buffer (if not NULL). Returns the number of failed clients.
+static size_t run_clients(unsigned char *buffer, size_t clients, size_t blocks_per_client) {
+    pid_t *pids = calloc(clients, sizeof(pid_t));
+    size_t failed = 0;
+
+    if (pids == NULL) {
+        fprintf(stderr, "*** error: calloc(): %s\n", strerror(errno));
+        return clients;
+    }
+
+    for (size_t index = 0; index < clients; ++ index) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "*** error: fork(): %s\n", strerror(errno));
+            ++ failed;
+            continue;
+        }
+
+        if (pid == 0) {
+            unsigned char block[BLOCK_SIZE];
+            for (size_t block_index = 0; block_index < blocks_per_client; ++ block_index) {
+                unsigned char *ptr = buffer != NULL ?
+                    buffer + (index * blocks_per_client + block_index) * BLOCK_SIZE :
+                    block;
+                const int errnum = portable_get_random(ptr, BLOCK_SIZE);
+                if (errnum != 0) {
+                    fprintf(stderr, "*** error: portable_get_random(): %s\n", strerror(errnum));
+                    _exit(1);
+                }
+            }
+            _exit(0);
+        }
+
+        pids[index] = pid;
+    }
+
+    // the daemon is a child too, so only wait for the clients
+    for (size_t index = 0; index < clients; ++ index) {
+        int status = 0;
+        if (pids[index] > 0 && (waitpid(pids[index], &status, 0) < 0 ||
+                !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            ++ failed;
+        }
+    }
+
+    free(pids);
+    return failed;
+}
+
+static int compare_blocks(const void *lhs, const void *rhs) {
+    return memcmp(lhs, rhs, BLOCK_SIZE);
+}
+
+int main(int argc, char *argv[]) {
+    char tmpdir[] = "/tmp/portable-get-random-XXXXXX";
+    char path[sizeof(tmpdir) + 16];
+    unsigned char *buffer = NULL;
+    size_t buffer_size = 0;
+    PortableGetRandom_ShmHead *head = NULL;
+    int writable = 0;
+    size_t clients = 64;
+    size_t blocks_per_client = 2000;
+    pid_t daemon_pid = -1;
+    int have_tmpdir = 0;
+    int status = 0;
+
+    if (argc < 2 || argc > 4 ||
+        (argc > 2 && parse_count(argv[2], &clients) != 0) ||
+        (argc > 3 && parse_count(argv[3], &blocks_per_client) != 0)) {
+        usage(argc, argv);
+        goto error;
+    }
+
+    if (mkdtemp(tmpdir) == NULL) {
+        fprintf(stderr, "*** error: mkdtemp(): %s\n", strerror(errno));
+        goto error;
+    }
+    have_tmpdir = 1;
+    snprintf(path, sizeof(path), "%s/daemon.sock", tmpdir);
+    setenv(PORTABLE_GET_RANDOM_SOCKET_ENV, path, 1);
+
+    // nobody is listening yet
+    if (run_clients(NULL, clients, 1) != 0) {
+        fprintf(stderr, "*** error: clients failed without a daemon\n");
+        goto error;
+    }
+    printf("fallback without daemon: ok\n");
+
+    daemon_pid = fork();
+    if (daemon_pid < 0) {
+        fprintf(stderr, "*** error: fork(): %s\n", strerror(errno));
+        goto error;
+    }
+
+    if (daemon_pid == 0) {
+        execl(argv[1], argv[1], path, (char*)NULL);
+        fprintf(stderr, "*** error: exec(%s): %s\n", argv[1], strerror(errno));
+        _exit(127);
+    }
+
+    for (long waited = 0; (head = connect_head(path, &writable)) == NULL; waited += 10) {
+        if (waitpid(daemon_pid, NULL, WNOHANG) != 0) {
+            // already reaped, don't kill whatever process gets its pid next
+            daemon_pid = -1;
+            fprintf(stderr, "*** error: daemon exited early\n");
+            goto error;
+        }
+
+        if (waited >= DAEMON_START_TIMEOUT_MSEC) {
+            fprintf(stderr, "*** error: daemon didn't start\n");
+            goto error;
+        }
+        sleep_msec(10);
+    }
+
+    if (writable) {
+        fprintf(stderr, "*** error: clients can write to the ring\n");
+        goto error;
+    }
+    printf("ring is read-only: ok\n");
+
+    const size_t block_count = clients * blocks_per_client;
+    buffer_size = block_count * BLOCK_SIZE;
+    buffer = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        buffer = NULL;
+        fprintf(stderr, "*** error: mmap(): %s\n", strerror(errno));
+        goto error;
+    }
+
+    const size_t failed = run_clients(buffer, clients, blocks_per_client);
+    if (failed != 0) {
+        fprintf(stderr, "*** error: %zu of %zu clients failed\n", failed, clients);
+        goto error;
+    }
+
+    const unsigned long long served = __atomic_load_n(&head->head, __ATOMIC_ACQUIRE);
+    printf("%zu clients claimed %zu blocks, %llu (%.1f%%) of them from the daemon\n",
+        clients, block_count, served, 100.0 * served / block_count);
+
+    // At least twice the ring means the daemon refilled all of it while the
+    // clients drained it. How much more mostly depends on whether the daemon
+    // has to share a CPU with the clients.
+    const unsigned long long min_served = 2 * PORTABLE_GET_RANDOM_SHM_BLOCK_COUNT;
+    if (block_count >= min_served && served < min_served) {
+        fprintf(stderr, "*** error: daemon served only %llu blocks, expected at least %llu\n", served, min_served);
+        goto error;
+    } else if (served == 0) {
+        fprintf(stderr, "*** error: no client used the daemon\n");
+        goto error;
+    }
+
+    qsort(buffer, block_count, BLOCK_SIZE, compare_blocks);
+    for (size_t index = 1; index < block_count; ++ index) {
+        if (memcmp(buffer + (index - 1) * BLOCK_SIZE, buffer + index * BLOCK_SIZE, BLOCK_SIZE) == 0) {
+            fprintf(stderr, "*** error: a block was handed out twice\n");
+            goto error;
+        }
+    }
+    printf("all blocks unique: ok\n");
+
+    kill(daemon_pid, SIGTERM);
+    int daemon_status = 0;
+    waitpid(daemon_pid, &daemon_status, 0);
+    daemon_pid = -1;
+
+    if (!WIFEXITED(daemon_status) || WEXITSTATUS(daemon_status) != 0) {
+        fprintf(stderr, "*** error: daemon didn't exit cleanly\n");
+        goto error;
+    }
+
+    if (access(path, F_OK) == 0) {
+        fprintf(stderr, "*** error: daemon didn't remove its socket\n");
+        goto error;
+    }
+
+    if (run_clients(NULL, clients, 1) != 0) {
+        fprintf(stderr, "*** error: clients failed after the daemon stopped\n");
+        goto error;
+    }
+    printf("fallback after daemon stopped: ok\n");
+
+    goto cleanup;
+
+error:
+    status = 1;
+
+cleanup:
+    if (daemon_pid > 0) {
+        kill(daemon_pid, SIGTERM);
+        waitpid(daemon_pid, NULL, 0);
+    }
+
+    if (head != NULL) {
+        munmap(head, sizeof(PortableGetRandom_ShmHead));
+    }
+
+    if (buffer != NULL) {
+        munmap(buffer, buffer_size);
+    }
+
+    if (have_tmpdir) {
+        unlink(path);
+        rmdir(tmpdir);
+    }
+
+    return status;
+}
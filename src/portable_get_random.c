@@ -19,6 +19,14 @@
 
 #include "portable_get_random.h"
 
+#if defined(PORTABLE_GET_RANDOM_SHM)
+    // The selected implementation becomes the fallback of the shared memory
+    // client that is defined at the end of this file.
+static int portable_get_random_local(unsigned char *buffer, size_t size);
+
+    #define portable_get_random portable_get_random_local
+#endif
+
 #define PORTABLE_GET_RANDOM_IMPL_getentropy         1
 #define PORTABLE_GET_RANDOM_IMPL_getrandom          2
 #define PORTABLE_GET_RANDOM_IMPL_file               3
@@ -38,6 +46,11 @@
     // we compile with -std=c99 but here we do want getentropy()
     #define _DEFAULT_SOURCE 1
 
+    #if defined(PORTABLE_GET_RANDOM_SHM)
+        // for struct ucred
+        #define _GNU_SOURCE 1
+    #endif
+
     #include <sys/syscall.h>
 
     #if defined(SYS_getrandom)
@@ -94,6 +107,14 @@
     #define PORTABLE_GET_RANDOM_IMPL PORTABLE_GET_RANDOM_IMPL_default
 #endif
 
+#if defined(PORTABLE_GET_RANDOM_AUTOTUNE) && PORTABLE_GET_RANDOM_IMPL != PORTABLE_GET_RANDOM_IMPL_dlsym
+    #error "PORTABLE_GET_RANDOM_AUTOTUNE is only supported by the dlsym implementation."
+#endif
+
+#if defined(PORTABLE_GET_RANDOM_SHM) && ((defined(_WIN32) || defined(_WIN64)) || !defined(__GNUC__))
+    #error "PORTABLE_GET_RANDOM_SHM is only supported on POSIX systems with GCC or clang."
+#endif
+
 #if PORTABLE_GET_RANDOM_IMPL == PORTABLE_GET_RANDOM_IMPL_getrandom
 
     #include <errno.h>
@@ -171,10 +192,20 @@ enum PortableGetRandom_Impl {
 
     #include <dlfcn.h>
     #include <errno.h>
+    #include <fcntl.h>
+    #include <pthread.h>
     #include <stdio.h>
     #include <unistd.h>
 
+    #if defined(PORTABLE_GET_RANDOM_AUTOTUNE)
+        #include <stdlib.h>
+        #include <string.h>
+        #include <stdint.h>
+        #include <time.h>
+    #endif
+
     #define MAX_ENTROPY_SIZE 256
+    #define GRND_NONBLOCK 1
     #define GRND_RANDOM 2
 
     // RTLD_DEFAULT is not definded with -std=c99 but it is just NULL for GNU libc
@@ -182,60 +213,50 @@ enum PortableGetRandom_Impl {
         #define RTLD_DEFAULT NULL
     #endif
 
-int portable_get_random(unsigned char *buffer, size_t size) {
-    static enum PortableGetRandom_Impl impl = PortableGetRandom_Uninitialized;
+// portable_get_random_init() runs exactly once and other threads wait for it,
+// so they never see the dispatch table (or the dl_* pointers) half set up.
+static pthread_once_t portable_get_random_once = PTHREAD_ONCE_INIT;
+static enum PortableGetRandom_Impl portable_get_random_impl = PortableGetRandom_Uninitialized;
     #if defined(__APPLE__)
-    static int (*SecRandomCopyBytes)(SecRandomRef, size_t, uint8_t *) = NULL;
-    static SecRandomRef kSecRandomDefault = NULL;
+static int (*dl_SecRandomCopyBytes)(SecRandomRef, size_t, uint8_t *) = NULL;
+static SecRandomRef dl_kSecRandomDefault = NULL;
     #elif !defined(__HAIKU__)
-    static ssize_t (*getrandom)(void *, size_t, unsigned int) = NULL;
-    #endif
-    static int (*getentropy)(void *, size_t) = NULL;
-
-dispatch:
-    switch (impl) {
-        case PortableGetRandom_Uninitialized:
-        {
-    #if !defined(__HAIKU__) && !defined(__APPLE__)
-            *(void**) &getrandom = dlsym(RTLD_DEFAULT, "getrandom");
-            if (getrandom) {
-                impl = PortableGetRandom_GetRandom;
-                goto dispatch;
-            }
+static ssize_t (*dl_getrandom)(void *, size_t, unsigned int) = NULL;
     #endif
-
-            *(void**) &getentropy = dlsym(RTLD_DEFAULT, "getentropy");
-            if (getentropy) {
-                impl = PortableGetRandom_GetEntropy;
-                goto dispatch;
-            }
+static int (*dl_getentropy)(void *, size_t) = NULL;
 
     #if defined(__APPLE__)
-            void *Security = dlopen("/System/Library/Frameworks/Security.framework/Versions/Current/Security", RTLD_LAZY | RTLD_LOCAL);
-            if (Security != NULL) {
-                void ** kSecRandomDefaultPtr = dlsym(Security, "kSecRandomDefault");
-                *(void**) &SecRandomCopyBytes = dlsym(Security, "SecRandomCopyBytes");
-                if (kSecRandomDefaultPtr && SecRandomCopyBytes) {
-                    kSecRandomDefault = *kSecRandomDefaultPtr;
-                    impl = PortableGetRandom_SecRandomCopyBytes;
-                    goto dispatch;
-                } else {
-                    dlclose(Security);
-                }
-            }
+static int portable_get_random_load_security(void) {
+    void *Security = dlopen("/System/Library/Frameworks/Security.framework/Versions/Current/Security", RTLD_LAZY | RTLD_LOCAL);
+    if (Security != NULL) {
+        void ** kSecRandomDefaultPtr = dlsym(Security, "kSecRandomDefault");
+        *(void**) &dl_SecRandomCopyBytes = dlsym(Security, "SecRandomCopyBytes");
+        if (kSecRandomDefaultPtr && dl_SecRandomCopyBytes) {
+            dl_kSecRandomDefault = *kSecRandomDefaultPtr;
+            return 1;
+        } else {
+            dl_SecRandomCopyBytes = NULL;
+            dlclose(Security);
+        }
+    }
+    return 0;
+}
     #endif
 
-            impl = PortableGetRandom_DevRandom;
-            goto dispatch;
-            break;
-        }
+// With nonblocking set the same sources are read, but getrandom() gets
+// GRND_NONBLOCK and the file is opened with O_NONBLOCK, so they fail with
+// EAGAIN instead of waiting for entropy. This is used by the autotuning
+// benchmark, which must not stall on kernels before 5.6 where GRND_RANDOM and
+// /dev/random block, and which counts such a backend as failed.
+static int portable_get_random_with(enum PortableGetRandom_Impl impl, unsigned char *buffer, size_t size, int nonblocking) {
+    switch (impl) {
     #if !defined(__APPLE__) && !defined(__HAIKU__)
         case PortableGetRandom_GetRandom:
             while (size > 0) {
-                const ssize_t count = getrandom(buffer, size, GRND_RANDOM);
+                const ssize_t count = dl_getrandom(buffer, size, nonblocking ? GRND_RANDOM | GRND_NONBLOCK : GRND_RANDOM);
                 if (count < 0) {
                     const int errnum = errno;
-                    if (errnum == EINTR || errnum == EAGAIN) {
+                    if (errnum == EINTR || (errnum == EAGAIN && !nonblocking)) {
                         continue;
                     }
                     return errnum;
@@ -250,14 +271,14 @@ dispatch:
             while (size > 0) {
                 const size_t count = size < MAX_ENTROPY_SIZE ? size : MAX_ENTROPY_SIZE;
 
-                if (getentropy(buffer, count) != 0) {
+                if (dl_getentropy(buffer, count) != 0) {
                     const int errnum = errno;
                     if (errnum == EINTR || errnum == EAGAIN) {
                         continue;
                     }
                     return errnum;
                 }
-                
+
                 buffer += count;
                 size   -= count;
             }
@@ -266,27 +287,27 @@ dispatch:
     #if defined(__APPLE__)
         case PortableGetRandom_SecRandomCopyBytes:
         {
-            int status = SecRandomCopyBytes(kSecRandomDefault, size, buffer);
-        
+            int status = dl_SecRandomCopyBytes(dl_kSecRandomDefault, size, buffer);
+
             switch (status) {
                 case errSecSuccess:
                     return 0;
-        
+
                 case errSecUnimplemented:
                     return ENOSYS;
-        
+
                 case errSecDiskFull:
                     return EDQUOT;
-        
+
                 case errSecIO:
                     return EIO;
-        
+
                 case errSecAllocate:
                     return ENOMEM;
-        
+
                 case errSecWrPerm:
                     return EACCES;
-        
+
                 case errSecParam:
                 default:
                     return EINVAL;
@@ -297,6 +318,30 @@ dispatch:
 
         case PortableGetRandom_DevRandom:
         {
+            if (nonblocking) {
+                const int fd = open(PORTABLE_GET_RANDOM_FILE, O_RDONLY | O_NONBLOCK);
+                if (fd < 0) {
+                    return errno;
+                }
+
+                while (size > 0) {
+                    const ssize_t count = read(fd, buffer, size);
+                    if (count <= 0) {
+                        const int errnum = count < 0 ? errno : EIO;
+                        if (errnum == EINTR) {
+                            continue;
+                        }
+                        close(fd);
+                        return errnum;
+                    }
+                    buffer += count;
+                    size   -= count;
+                }
+
+                close(fd);
+                return 0;
+            }
+
             FILE *stream = fopen(PORTABLE_GET_RANDOM_FILE, "rb");
 
             if (stream == NULL) {
@@ -319,6 +364,369 @@ dispatch:
     }
 }
 
+    #if defined(PORTABLE_GET_RANDOM_AUTOTUNE)
+
+// Requests are routed by size class. A request of size n belongs to the first
+// class whose upper bound is >= n, the last class takes everything bigger.
+        #define PORTABLE_GET_RANDOM_SIZE_CLASS_COUNT 8
+        #define PORTABLE_GET_RANDOM_AUTOTUNE_MAX_SIZE (64 * 1024)
+        #define PORTABLE_GET_RANDOM_AUTOTUNE_BYTES    (64 * 1024)
+        #define PORTABLE_GET_RANDOM_AUTOTUNE_MIN_REPS 2
+        #define PORTABLE_GET_RANDOM_AUTOTUNE_MAX_REPS 64
+        #define PORTABLE_GET_RANDOM_AUTOTUNE_ROUNDS   5
+        // how much faster (in percent) another backend has to be to replace the default one
+        #define PORTABLE_GET_RANDOM_AUTOTUNE_MARGIN   25
+        #define PORTABLE_GET_RANDOM_TUNING_ENV      "PORTABLE_GET_RANDOM_TUNING"
+        #define PORTABLE_GET_RANDOM_TUNING_FILE_ENV "PORTABLE_GET_RANDOM_TUNING_FILE"
+        #define PORTABLE_GET_RANDOM_TUNING_MAX_LEN  256
+
+static const size_t portable_get_random_size_class_bounds[PORTABLE_GET_RANDOM_SIZE_CLASS_COUNT] = {
+    16, 64, 256, 1024, 4096, 16384, 65536, SIZE_MAX,
+};
+
+static enum PortableGetRandom_Impl portable_get_random_size_class_impls[PORTABLE_GET_RANDOM_SIZE_CLASS_COUNT];
+
+static const struct {
+    enum PortableGetRandom_Impl impl;
+    const char *name;
+} portable_get_random_impl_names[] = {
+        #if defined(__APPLE__)
+    { PortableGetRandom_SecRandomCopyBytes, "SecRandomCopyBytes" },
+        #elif !defined(__HAIKU__)
+    { PortableGetRandom_GetRandom,          "getrandom"          },
+        #endif
+    { PortableGetRandom_GetEntropy,         "getentropy"         },
+    { PortableGetRandom_DevRandom,          "file"               },
+};
+
+        #define PORTABLE_GET_RANDOM_IMPL_COUNT (sizeof(portable_get_random_impl_names) / sizeof(portable_get_random_impl_names[0]))
+
+static size_t portable_get_random_size_class(size_t size) {
+    size_t index = 0;
+    while (size > portable_get_random_size_class_bounds[index]) {
+        ++ index;
+    }
+    return index;
+}
+
+static int portable_get_random_available(enum PortableGetRandom_Impl impl) {
+    switch (impl) {
+        #if defined(__APPLE__)
+        case PortableGetRandom_SecRandomCopyBytes:
+            return dl_SecRandomCopyBytes != NULL;
+        #elif !defined(__HAIKU__)
+        case PortableGetRandom_GetRandom:
+            return dl_getrandom != NULL;
+        #endif
+
+        case PortableGetRandom_GetEntropy:
+            return dl_getentropy != NULL;
+
+        case PortableGetRandom_DevRandom:
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+// Serializes the dispatch table as a comma separated list of backend names,
+// one per size class, e.g.: "getrandom,getrandom,...,getentropy"
+static int portable_get_random_format_tuning(char *buffer, size_t size) {
+    size_t offset = 0;
+
+    for (size_t index = 0; index < PORTABLE_GET_RANDOM_SIZE_CLASS_COUNT; ++ index) {
+        const char *name = NULL;
+        for (size_t impl_index = 0; impl_index < PORTABLE_GET_RANDOM_IMPL_COUNT; ++ impl_index) {
+            if (portable_get_random_impl_names[impl_index].impl == portable_get_random_size_class_impls[index]) {
+                name = portable_get_random_impl_names[impl_index].name;
+                break;
+            }
+        }
+
+        if (name == NULL) {
+            return EINVAL;
+        }
+
+        const int count = snprintf(buffer + offset, size - offset, "%s%s", index > 0 ? "," : "", name);
+        if (count < 0) {
+            return EINVAL;
+        }
+
+        if ((size_t)count >= size - offset) {
+            return ERANGE;
+        }
+
+        offset += count;
+    }
+
+    return 0;
+}
+
+// Returns 0 only if tuning names an available backend for every size class.
+// On failure the current dispatch table is left untouched.
+static int portable_get_random_parse_tuning(const char *tuning) {
+    enum PortableGetRandom_Impl impls[PORTABLE_GET_RANDOM_SIZE_CLASS_COUNT];
+
+    for (size_t index = 0; index < PORTABLE_GET_RANDOM_SIZE_CLASS_COUNT; ++ index) {
+        const char *end = tuning;
+        while (*end && *end != ',' && *end != '\n') {
+            ++ end;
+        }
+        const size_t len = end - tuning;
+
+        int found = 0;
+        for (size_t impl_index = 0; impl_index < PORTABLE_GET_RANDOM_IMPL_COUNT; ++ impl_index) {
+            const char *name = portable_get_random_impl_names[impl_index].name;
+            if (strlen(name) == len && memcmp(name, tuning, len) == 0) {
+                impls[index] = portable_get_random_impl_names[impl_index].impl;
+                found = 1;
+                break;
+            }
+        }
+
+        if (!found || !portable_get_random_available(impls[index])) {
+            return EINVAL;
+        }
+
+        if (index + 1 < PORTABLE_GET_RANDOM_SIZE_CLASS_COUNT) {
+            if (*end != ',') {
+                return EINVAL;
+            }
+            tuning = end + 1;
+        } else if (*end && *end != '\n') {
+            return EINVAL;
+        }
+    }
+
+    memcpy(portable_get_random_size_class_impls, impls, sizeof(impls));
+    return 0;
+}
+
+static double portable_get_random_now(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return 0.0;
+    }
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Microbenchmarks every available backend at the upper bound of every size
+// class. Every backend is measured in several interleaved rounds and its
+// fastest round counts. The default backend is kept unless another one is
+// faster by PORTABLE_GET_RANDOM_AUTOTUNE_MARGIN. Backends that fail, including
+// those that would block, are skipped.
+static void portable_get_random_benchmark(enum PortableGetRandom_Impl fallback) {
+    unsigned char *buffer = malloc(PORTABLE_GET_RANDOM_AUTOTUNE_MAX_SIZE);
+
+    for (size_t index = 0; index < PORTABLE_GET_RANDOM_SIZE_CLASS_COUNT; ++ index) {
+        portable_get_random_size_class_impls[index] = fallback;
+    }
+
+    if (buffer == NULL) {
+        return;
+    }
+
+    for (size_t index = 0; index < PORTABLE_GET_RANDOM_SIZE_CLASS_COUNT; ++ index) {
+        size_t size = portable_get_random_size_class_bounds[index];
+        if (size > PORTABLE_GET_RANDOM_AUTOTUNE_MAX_SIZE) {
+            size = PORTABLE_GET_RANDOM_AUTOTUNE_MAX_SIZE;
+        }
+
+        size_t reps = PORTABLE_GET_RANDOM_AUTOTUNE_BYTES / size;
+        if (reps > PORTABLE_GET_RANDOM_AUTOTUNE_MAX_REPS) {
+            reps = PORTABLE_GET_RANDOM_AUTOTUNE_MAX_REPS;
+        } else if (reps < PORTABLE_GET_RANDOM_AUTOTUNE_MIN_REPS) {
+            reps = PORTABLE_GET_RANDOM_AUTOTUNE_MIN_REPS;
+        }
+
+        // best time per backend, negative if unavailable or failed
+        double times[PORTABLE_GET_RANDOM_IMPL_COUNT];
+
+        for (size_t impl_index = 0; impl_index < PORTABLE_GET_RANDOM_IMPL_COUNT; ++ impl_index) {
+            const enum PortableGetRandom_Impl impl = portable_get_random_impl_names[impl_index].impl;
+
+            // warm up (page in buffer, open files etc.)
+            times[impl_index] = portable_get_random_available(impl) &&
+                portable_get_random_with(impl, buffer, size, 1) == 0 ? 0.0 : -1.0;
+        }
+
+        for (size_t round = 0; round < PORTABLE_GET_RANDOM_AUTOTUNE_ROUNDS; ++ round) {
+            for (size_t impl_index = 0; impl_index < PORTABLE_GET_RANDOM_IMPL_COUNT; ++ impl_index) {
+                const enum PortableGetRandom_Impl impl = portable_get_random_impl_names[impl_index].impl;
+                if (times[impl_index] < 0.0) {
+                    continue;
+                }
+
+                int failed = 0;
+                const double start = portable_get_random_now();
+                for (size_t rep = 0; rep < reps; ++ rep) {
+                    if (portable_get_random_with(impl, buffer, size, 1) != 0) {
+                        failed = 1;
+                        break;
+                    }
+                }
+                const double time = portable_get_random_now() - start;
+
+                if (failed) {
+                    times[impl_index] = -1.0;
+                } else if (round == 0 || time < times[impl_index]) {
+                    times[impl_index] = time;
+                }
+            }
+        }
+
+        double fallback_time = -1.0;
+        for (size_t impl_index = 0; impl_index < PORTABLE_GET_RANDOM_IMPL_COUNT; ++ impl_index) {
+            if (portable_get_random_impl_names[impl_index].impl == fallback) {
+                fallback_time = times[impl_index];
+                break;
+            }
+        }
+
+        // a failed default backend is replaced by the fastest working one
+        double best_time = fallback_time < 0.0 ? -1.0 : fallback_time * 100.0 / (100.0 + PORTABLE_GET_RANDOM_AUTOTUNE_MARGIN);
+        for (size_t impl_index = 0; impl_index < PORTABLE_GET_RANDOM_IMPL_COUNT; ++ impl_index) {
+            const double time = times[impl_index];
+            if (time >= 0.0 && (best_time < 0.0 || time < best_time)) {
+                best_time = time;
+                portable_get_random_size_class_impls[index] = portable_get_random_impl_names[impl_index].impl;
+            }
+        }
+    }
+
+    free(buffer);
+}
+
+// Writes to a temporary file that is then renamed, so concurrent processes
+// never read a half-written table. Saving is best effort, if it fails the next
+// process will just benchmark again.
+static void portable_get_random_save_tuning(const char *path, const char *tuning) {
+    const size_t len = strlen(path);
+    char *tmp_path = malloc(len + sizeof(".XXXXXX"));
+
+    if (tmp_path == NULL) {
+        return;
+    }
+
+    memcpy(tmp_path, path, len);
+    memcpy(tmp_path + len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    const int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        free(tmp_path);
+        return;
+    }
+
+    FILE *stream = fdopen(fd, "w");
+    if (stream == NULL) {
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return;
+    }
+
+    const int ok = fprintf(stream, "%s\n", tuning) >= 0;
+    if (fclose(stream) != 0 || !ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+}
+
+static void portable_get_random_autotune(enum PortableGetRandom_Impl fallback) {
+    char tuning[PORTABLE_GET_RANDOM_TUNING_MAX_LEN];
+
+    // Setuid and setgid programs must not let the caller pick the backends or a
+    // file to overwrite.
+    if (getuid() != geteuid() || getgid() != getegid()) {
+        portable_get_random_benchmark(fallback);
+        return;
+    }
+
+    const char *env_tuning = getenv(PORTABLE_GET_RANDOM_TUNING_ENV);
+    if (env_tuning != NULL && portable_get_random_parse_tuning(env_tuning) == 0) {
+        return;
+    }
+
+    const char *path = getenv(PORTABLE_GET_RANDOM_TUNING_FILE_ENV);
+    if (path != NULL && *path) {
+        FILE *stream = fopen(path, "r");
+        if (stream != NULL) {
+            const int ok = fgets(tuning, sizeof(tuning), stream) != NULL &&
+                           portable_get_random_parse_tuning(tuning) == 0;
+            fclose(stream);
+
+            if (ok) {
+                return;
+            }
+        }
+    }
+
+    portable_get_random_benchmark(fallback);
+
+    if (path != NULL && *path && portable_get_random_format_tuning(tuning, sizeof(tuning)) == 0) {
+        portable_get_random_save_tuning(path, tuning);
+    }
+}
+
+    #endif
+
+static void portable_get_random_init(void) {
+    enum PortableGetRandom_Impl impl = PortableGetRandom_DevRandom;
+
+    #if !defined(__HAIKU__) && !defined(__APPLE__)
+    *(void**) &dl_getrandom = dlsym(RTLD_DEFAULT, "getrandom");
+    if (dl_getrandom) {
+        impl = PortableGetRandom_GetRandom;
+    }
+    #endif
+
+    *(void**) &dl_getentropy = dlsym(RTLD_DEFAULT, "getentropy");
+    if (dl_getentropy && impl == PortableGetRandom_DevRandom) {
+        impl = PortableGetRandom_GetEntropy;
+    }
+
+    #if defined(__APPLE__)
+        // only load the Security framework if it is needed as a fallback or
+        // if it has to compete in the autotuning benchmark
+        #if !defined(PORTABLE_GET_RANDOM_AUTOTUNE)
+    if (impl == PortableGetRandom_DevRandom)
+        #endif
+    {
+        if (portable_get_random_load_security() && impl == PortableGetRandom_DevRandom) {
+            impl = PortableGetRandom_SecRandomCopyBytes;
+        }
+    }
+    #endif
+
+    #if defined(PORTABLE_GET_RANDOM_AUTOTUNE)
+    portable_get_random_autotune(impl);
+    #endif
+
+    portable_get_random_impl = impl;
+}
+
+int portable_get_random(unsigned char *buffer, size_t size) {
+    pthread_once(&portable_get_random_once, portable_get_random_init);
+
+    #if defined(PORTABLE_GET_RANDOM_AUTOTUNE)
+    return portable_get_random_with(portable_get_random_size_class_impls[portable_get_random_size_class(size)], buffer, size, 0);
+    #else
+    return portable_get_random_with(portable_get_random_impl, buffer, size, 0);
+    #endif
+}
+
+    #if defined(PORTABLE_GET_RANDOM_AUTOTUNE)
+        #define PORTABLE_GET_RANDOM_HAS_TUNING
+
+int portable_get_random_tuning(char *buffer, size_t size) {
+    pthread_once(&portable_get_random_once, portable_get_random_init);
+
+    return portable_get_random_format_tuning(buffer, size);
+}
+    #endif
+
 #elif (PORTABLE_GET_RANDOM_IMPL == PORTABLE_GET_RANDOM_IMPL_RtlGenRandom) || \
       (PORTABLE_GET_RANDOM_IMPL == PORTABLE_GET_RANDOM_IMPL_CryptGenRandom) || \
       (PORTABLE_GET_RANDOM_IMPL == PORTABLE_GET_RANDOM_IMPL_BCryptGenRandom) || \
@@ -589,3 +997,286 @@ int portable_get_random(unsigned char *buffer, size_t size) {
     #error "PORTABLE_GET_RANDOM_IMPL has an invalid value."
 
 #endif
+
+#if !defined(PORTABLE_GET_RANDOM_HAS_TUNING)
+
+    #include <errno.h>
+
+int portable_get_random_tuning(char *buffer, size_t size) {
+    (void)buffer;
+    (void)size;
+    return ENOSYS;
+}
+
+#endif
+
+#if defined(PORTABLE_GET_RANDOM_SHM)
+
+    #undef portable_get_random
+
+    #include "portable_get_random_shm.h"
+
+    #include <errno.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/time.h>
+    #include <sys/un.h>
+
+    #define PORTABLE_GET_RANDOM_SHM_TIMEOUT_USEC 100000
+    // failed claims per call before the rest of the request is read locally
+    #define PORTABLE_GET_RANDOM_SHM_MAX_RETRIES 256
+
+enum PortableGetRandom_ShmState {
+    PortableGetRandom_ShmUninitialized,
+    PortableGetRandom_ShmInitializing,
+    PortableGetRandom_ShmReady,
+    PortableGetRandom_ShmUnavailable,
+};
+
+static int portable_get_random_shm_state = PortableGetRandom_ShmUninitialized;
+static const PortableGetRandom_ShmHeader *portable_get_random_shm_header = NULL;
+static PortableGetRandom_ShmHead *portable_get_random_shm_head = NULL;
+
+// Only accept a daemon run by root or by ourself. Anyone can bind the socket
+// path in /tmp, but we don't want to take random numbers from just anyone.
+static int portable_get_random_shm_trusted(int sock) {
+    #if defined(__linux__)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        return 0;
+    }
+    const uid_t uid = cred.uid;
+    #else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(sock, &uid, &gid) != 0) {
+        return 0;
+    }
+    #endif
+    return uid == 0 || uid == geteuid();
+}
+
+// Receives the read-only ring and the head object. Returns 0 on success.
+static int portable_get_random_shm_recv_fds(int sock, int fds[2]) {
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t count;
+    do {
+        count = recvmsg(sock, &msg, 0);
+    } while (count < 0 && errno == EINTR);
+
+    if (count <= 0) {
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type  != SCM_RIGHTS) {
+        return -1;
+    }
+
+    if (cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)) || (msg.msg_flags & MSG_CTRUNC)) {
+        // don't leak whatever we got
+        size_t fd_count = cmsg->cmsg_len > CMSG_LEN(0) ? (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int) : 0;
+        if (fd_count > 2) {
+            fd_count = 2;
+        }
+        for (size_t index = 0; index < fd_count; ++ index) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + index * sizeof(int), sizeof(fd));
+            close(fd);
+        }
+        return -1;
+    }
+
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    return 0;
+}
+
+static const PortableGetRandom_ShmHeader *portable_get_random_shm_map(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PortableGetRandom_ShmHeader)) {
+        return NULL;
+    }
+
+    const size_t size = st.st_size;
+    PortableGetRandom_ShmHeader *header = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        return NULL;
+    }
+
+    const uint64_t block_count = header->block_count;
+    const uint64_t block_size  = header->block_size;
+    if (header->magic   != PORTABLE_GET_RANDOM_SHM_MAGIC   ||
+        header->version != PORTABLE_GET_RANDOM_SHM_VERSION ||
+        block_count == 0 || block_size == 0 ||
+        header->seqs_offset % sizeof(uint64_t) != 0 ||
+        header->seqs_offset < sizeof(PortableGetRandom_ShmHeader) ||
+        header->seqs_offset > size ||
+        block_count > (size - header->seqs_offset) / sizeof(uint64_t) ||
+        header->data_offset < header->seqs_offset + block_count * sizeof(uint64_t) ||
+        header->data_offset > size ||
+        block_count > (size - header->data_offset) / block_size) {
+        munmap(header, size);
+        return NULL;
+    }
+
+    return header;
+}
+
+static PortableGetRandom_ShmHead *portable_get_random_shm_map_head(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PortableGetRandom_ShmHead)) {
+        return NULL;
+    }
+
+    PortableGetRandom_ShmHead *head = mmap(NULL, sizeof(PortableGetRandom_ShmHead), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (head == MAP_FAILED) {
+        return NULL;
+    }
+
+    return head;
+}
+
+static void portable_get_random_shm_init(void) {
+    const PortableGetRandom_ShmHeader *header = NULL;
+    PortableGetRandom_ShmHead *head = NULL;
+    const char *path = getenv(PORTABLE_GET_RANDOM_SOCKET_ENV);
+    if (path == NULL || !*path) {
+        path = PORTABLE_GET_RANDOM_SOCKET;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        goto done;
+    }
+    strcpy(addr.sun_path, path);
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        goto done;
+    }
+
+    // Don't let a stuck daemon block the client. Linux waits in connect() while
+    // the listen backlog is full and limits that with the send timeout, BSDs
+    // refuse the connection right away.
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = PORTABLE_GET_RANDOM_SHM_TIMEOUT_USEC };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+        portable_get_random_shm_trusted(sock)) {
+        int fds[2];
+        if (portable_get_random_shm_recv_fds(sock, fds) == 0) {
+            head = portable_get_random_shm_map_head(fds[1]);
+            if (head != NULL) {
+                header = portable_get_random_shm_map(fds[0]);
+                if (header == NULL) {
+                    munmap(head, sizeof(PortableGetRandom_ShmHead));
+                    head = NULL;
+                }
+            }
+            close(fds[0]);
+            close(fds[1]);
+        }
+    }
+
+    close(sock);
+
+done:
+    portable_get_random_shm_header = header;
+    portable_get_random_shm_head   = head;
+    __atomic_store_n(&portable_get_random_shm_state,
+        header != NULL ? PortableGetRandom_ShmReady : PortableGetRandom_ShmUnavailable,
+        __ATOMIC_RELEASE);
+}
+
+// Claims blocks until size bytes are copied, the ring is empty, or claiming
+// failed PORTABLE_GET_RANDOM_SHM_MAX_RETRIES times. The latter bounds the loop
+// even if another client moved head to where no block will ever be ready.
+// Unused bytes of the last block are discarded. Returns the number of bytes
+// copied.
+static size_t portable_get_random_shm_claim(unsigned char *buffer, size_t size) {
+    const PortableGetRandom_ShmHeader *header = portable_get_random_shm_header;
+    PortableGetRandom_ShmHead *head = portable_get_random_shm_head;
+    const uint64_t block_count = header->block_count;
+    const size_t   block_size  = header->block_size;
+    const uint64_t *seqs = (const uint64_t*)((const unsigned char*)header + header->seqs_offset);
+    const unsigned char *data = (const unsigned char*)header + header->data_offset;
+    size_t offset  = 0;
+    size_t retries = 0;
+
+    while (offset < size && retries < PORTABLE_GET_RANDOM_SHM_MAX_RETRIES) {
+        uint64_t pos = __atomic_load_n(&head->head, __ATOMIC_ACQUIRE);
+        const uint64_t slot = pos % block_count;
+        const uint64_t seq  = __atomic_load_n(&seqs[slot], __ATOMIC_ACQUIRE);
+
+        if (seq < pos + 1) {
+            // daemon didn't catch up yet
+            break;
+        }
+
+        if (seq > pos + 1) {
+            // somebody else claimed pos and the slot got refilled already
+            ++ retries;
+            continue;
+        }
+
+        const size_t count = size - offset < block_size ? size - offset : block_size;
+        memcpy(buffer + offset, data + slot * block_size, count);
+
+        if (__atomic_compare_exchange_n(&head->head, &pos, pos + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            offset += count;
+        } else {
+            ++ retries;
+        }
+    }
+
+    return offset;
+}
+
+int portable_get_random(unsigned char *buffer, size_t size) {
+    int state = __atomic_load_n(&portable_get_random_shm_state, __ATOMIC_ACQUIRE);
+
+    if (state == PortableGetRandom_ShmUninitialized) {
+        if (__atomic_compare_exchange_n(&portable_get_random_shm_state, &state,
+                PortableGetRandom_ShmInitializing, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            portable_get_random_shm_init();
+            state = __atomic_load_n(&portable_get_random_shm_state, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    if (state == PortableGetRandom_ShmReady) {
+        const size_t count = portable_get_random_shm_claim(buffer, size);
+        buffer += count;
+        size   -= count;
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    return portable_get_random_local(buffer, size);
+}
+
+#endif
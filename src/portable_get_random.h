@@ -36,6 +36,25 @@ extern "C" {
 
 PORTABLE_GET_RANDOM_EXPORT int portable_get_random(unsigned char *buffer, size_t size);
 
+// Writes the autotuned dispatch table as a NUL terminated string into buffer.
+// The string can be passed to later processes via the environment variable
+// PORTABLE_GET_RANDOM_TUNING to skip the benchmark. Returns ENOSYS if the
+// library wasn't compiled with PORTABLE_GET_RANDOM_AUTOTUNE and ERANGE if
+// buffer is too small.
+PORTABLE_GET_RANDOM_EXPORT int portable_get_random_tuning(char *buffer, size_t size);
+
+// Maps size bytes of random memory. Under Linux pages are only filled with
+// random bytes when they are first touched (via userfaultfd). Elsewhere, or if
+// userfaultfd isn't available or the environment variable
+// PORTABLE_GET_RANDOM_MAP_EAGER is set to a non-empty value, the whole mapping
+// is filled upfront, using one thread per CPU on POSIX systems and a single
+// thread under Windows. Release it with portable_get_random_unmap().
+// A lazily filled mapping is not inherited by fork()ed children (MADV_DONTFORK),
+// a child touching it gets a segmentation fault instead of non-random bytes.
+PORTABLE_GET_RANDOM_EXPORT int portable_get_random_map(unsigned char **buffer, size_t size);
+
+PORTABLE_GET_RANDOM_EXPORT int portable_get_random_unmap(unsigned char *buffer, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
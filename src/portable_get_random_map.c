@@ -0,0 +1,417 @@
+// Copyright 2021 Mathias Panzenböck
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+// the Software, and to permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#if defined(__linux__)
+    // we compile with -std=c99 but here we do want MAP_ANONYMOUS and syscall()
+    #define _DEFAULT_SOURCE 1
+#elif defined(__APPLE__)
+    #define _DARWIN_C_SOURCE 1
+#endif
+
+#include "portable_get_random.h"
+
+#include <errno.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+
+    #include <windows.h>
+
+    // BCryptGenRandom() and CryptGenRandom() take a ULONG/DWORD size
+    #define PORTABLE_GET_RANDOM_MAP_CHUNK_SIZE (1024 * 1024 * 1024)
+
+// No userfaultfd and no threads here, the mapping is just filled eagerly.
+int portable_get_random_map(unsigned char **bufferptr, size_t size) {
+    if (bufferptr == NULL || size == 0) {
+        return EINVAL;
+    }
+
+    unsigned char *buffer = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (buffer == NULL) {
+        return ENOMEM;
+    }
+
+    for (size_t offset = 0; offset < size; offset += PORTABLE_GET_RANDOM_MAP_CHUNK_SIZE) {
+        const size_t rem = size - offset;
+        const int errnum = portable_get_random(buffer + offset, rem < PORTABLE_GET_RANDOM_MAP_CHUNK_SIZE ? rem : PORTABLE_GET_RANDOM_MAP_CHUNK_SIZE);
+        if (errnum != 0) {
+            VirtualFree(buffer, 0, MEM_RELEASE);
+            return errnum;
+        }
+    }
+
+    *bufferptr = buffer;
+    return 0;
+}
+
+int portable_get_random_unmap(unsigned char *buffer, size_t size) {
+    (void)size;
+
+    if (!VirtualFree(buffer, 0, MEM_RELEASE)) {
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+#else
+
+    #include <pthread.h>
+    #include <stdlib.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+
+    #if defined(__linux__)
+        #include <sys/syscall.h>
+
+        #if defined(SYS_userfaultfd)
+            #define PORTABLE_GET_RANDOM_MAP_UFFD
+            // skips userfaultfd if set, e.g. to benchmark the eager fill
+            #define PORTABLE_GET_RANDOM_MAP_EAGER_ENV "PORTABLE_GET_RANDOM_MAP_EAGER"
+
+            #include <fcntl.h>
+            #include <poll.h>
+            #include <stdint.h>
+            #include <sys/ioctl.h>
+            #include <linux/userfaultfd.h>
+        #endif
+    #endif
+
+    #if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+        #define MAP_ANONYMOUS MAP_ANON
+    #endif
+
+    // don't start a thread for less than that
+    #define PORTABLE_GET_RANDOM_MAP_MIN_CHUNK_SIZE (1024 * 1024)
+    #define PORTABLE_GET_RANDOM_MAP_MAX_THREADS    64
+
+typedef struct PortableGetRandom_FillTask {
+    pthread_t thread;
+    unsigned char *buffer;
+    size_t size;
+    int errnum;
+} PortableGetRandom_FillTask;
+
+static void *portable_get_random_fill_task(void *arg) {
+    PortableGetRandom_FillTask *task = arg;
+    task->errnum = portable_get_random(task->buffer, task->size);
+    return NULL;
+}
+
+// Fills buffer using one thread per online CPU, but at least
+// PORTABLE_GET_RANDOM_MAP_MIN_CHUNK_SIZE bytes per thread.
+static int portable_get_random_fill(unsigned char *buffer, size_t size, size_t page_size) {
+    PortableGetRandom_FillTask tasks[PORTABLE_GET_RANDOM_MAP_MAX_THREADS];
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t task_count = size / PORTABLE_GET_RANDOM_MAP_MIN_CHUNK_SIZE;
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    if (task_count > (size_t)cpus) {
+        task_count = cpus;
+    }
+    if (task_count > PORTABLE_GET_RANDOM_MAP_MAX_THREADS) {
+        task_count = PORTABLE_GET_RANDOM_MAP_MAX_THREADS;
+    }
+    if (task_count <= 1) {
+        return portable_get_random(buffer, size);
+    }
+
+    // Make sure lazily initialized implementations (dlsym, shared memory
+    // client) are set up before they are used from several threads.
+    int errnum = portable_get_random(buffer, 0);
+    if (errnum != 0) {
+        return errnum;
+    }
+
+    size_t chunk_size = size / task_count;
+    chunk_size -= chunk_size % page_size;
+
+    size_t started = 0;
+    size_t offset  = 0;
+    for (; started < task_count - 1; ++ started) {
+        PortableGetRandom_FillTask *task = &tasks[started];
+        task->buffer = buffer + offset;
+        task->size   = chunk_size;
+        task->errnum = 0;
+
+        if (pthread_create(&task->thread, NULL, portable_get_random_fill_task, task) != 0) {
+            // fill the rest in this thread
+            break;
+        }
+
+        offset += chunk_size;
+    }
+
+    errnum = portable_get_random(buffer + offset, size - offset);
+
+    for (size_t index = 0; index < started; ++ index) {
+        pthread_join(tasks[index].thread, NULL);
+        if (errnum == 0) {
+            errnum = tasks[index].errnum;
+        }
+    }
+
+    return errnum;
+}
+
+    #if defined(PORTABLE_GET_RANDOM_MAP_UFFD)
+
+typedef struct PortableGetRandom_LazyMapping {
+    struct PortableGetRandom_LazyMapping *next;
+    unsigned char *buffer;
+    size_t size;
+    size_t page_size;
+    int uffd;
+    int stop_fds[2];
+    pthread_t thread;
+} PortableGetRandom_LazyMapping;
+
+static pthread_mutex_t portable_get_random_lazy_mappings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static PortableGetRandom_LazyMapping *portable_get_random_lazy_mappings = NULL;
+
+// Resolves page faults of one mapping by copying in a freshly filled page.
+static void *portable_get_random_lazy_handler(void *arg) {
+    PortableGetRandom_LazyMapping *mapping = arg;
+    unsigned char *page = malloc(mapping->page_size);
+
+    if (page == NULL) {
+        // There is no way to report this to the faulting thread and leaving
+        // the fault unresolved would hang it forever.
+        abort();
+    }
+
+    struct pollfd pfds[2] = {
+        { .fd = mapping->uffd,        .events = POLLIN, .revents = 0 },
+        { .fd = mapping->stop_fds[0], .events = POLLIN, .revents = 0 },
+    };
+
+    for (;;) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            abort();
+        }
+
+        if (pfds[1].revents) {
+            break;
+        }
+
+        struct uffd_msg msg;
+        const ssize_t count = read(mapping->uffd, &msg, sizeof(msg));
+        if (count != sizeof(msg) || msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        // Handing out zeros or recycled bytes as random data would be worse
+        // than crashing.
+        if (portable_get_random(page, mapping->page_size) != 0) {
+            abort();
+        }
+
+        struct uffdio_copy copy = {
+            .dst  = msg.arg.pagefault.address & ~((uint64_t)mapping->page_size - 1),
+            .src  = (uintptr_t)page,
+            .len  = mapping->page_size,
+            .mode = 0,
+        };
+
+        // EEXIST: another fault on the same page was already resolved
+        if (ioctl(mapping->uffd, UFFDIO_COPY, &copy) != 0 && errno != EEXIST && errno != EAGAIN) {
+            abort();
+        }
+    }
+
+    free(page);
+    return NULL;
+}
+
+// Registers buffer with a new userfaultfd and starts its handler thread.
+// Returns an error if userfaultfd isn't available (e.g. because
+// vm.unprivileged_userfaultfd is 0), the caller falls back to an eager fill.
+static int portable_get_random_map_lazy(unsigned char *buffer, size_t size, size_t page_size) {
+    PortableGetRandom_LazyMapping *mapping = malloc(sizeof(PortableGetRandom_LazyMapping));
+    int errnum = 0;
+
+    if (mapping == NULL) {
+        return ENOMEM;
+    }
+
+    mapping->buffer      = buffer;
+    mapping->size        = size;
+    mapping->page_size   = page_size;
+    mapping->stop_fds[0] = -1;
+    mapping->stop_fds[1] = -1;
+
+    // UFFD_USER_MODE_ONLY is not used because then a buffer that is passed to a
+    // syscall (e.g. write()) before it was touched would fail with EFAULT.
+    mapping->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (mapping->uffd < 0) {
+        errnum = errno;
+        goto error;
+    }
+
+    struct uffdio_api api = { .api = UFFD_API, .features = 0, .ioctls = 0 };
+    if (ioctl(mapping->uffd, UFFDIO_API, &api) != 0) {
+        errnum = errno;
+        goto error;
+    }
+
+    struct uffdio_register reg = {
+        .range  = { .start = (uintptr_t)buffer, .len = size },
+        .mode   = UFFDIO_REGISTER_MODE_MISSING,
+        .ioctls = 0,
+    };
+    if (ioctl(mapping->uffd, UFFDIO_REGISTER, &reg) != 0) {
+        errnum = errno;
+        goto error;
+    }
+
+    if (!(reg.ioctls & ((uint64_t)1 << _UFFDIO_COPY))) {
+        errnum = ENOSYS;
+        goto error;
+    }
+
+    // A forked child doesn't inherit the userfaultfd registration and would
+    // read untouched pages as zeros. Leave the mapping out of children
+    // instead, so they fault when touching it.
+    if (madvise(buffer, size, MADV_DONTFORK) != 0) {
+        errnum = errno;
+        goto error;
+    }
+
+    if (pipe(mapping->stop_fds) != 0) {
+        errnum = errno;
+        goto error;
+    }
+
+    // Set up lazily initialized implementations (dlsym, autotuning, shared
+    // memory client) here and not in the handler thread, so the first page
+    // fault doesn't have to wait for e.g. the autotuning benchmark.
+    errnum = portable_get_random(buffer, 0);
+    if (errnum != 0) {
+        goto error;
+    }
+
+    errnum = pthread_create(&mapping->thread, NULL, portable_get_random_lazy_handler, mapping);
+    if (errnum != 0) {
+        goto error;
+    }
+
+    pthread_mutex_lock(&portable_get_random_lazy_mappings_mutex);
+    mapping->next = portable_get_random_lazy_mappings;
+    portable_get_random_lazy_mappings = mapping;
+    pthread_mutex_unlock(&portable_get_random_lazy_mappings_mutex);
+
+    return 0;
+
+error:
+    // closing the userfaultfd also unregisters the range
+    if (mapping->uffd >= 0) {
+        close(mapping->uffd);
+    }
+
+    if (mapping->stop_fds[0] >= 0) {
+        close(mapping->stop_fds[0]);
+        close(mapping->stop_fds[1]);
+    }
+
+    // the caller fills the mapping eagerly, so children may inherit it again
+    madvise(buffer, size, MADV_DOFORK);
+
+    free(mapping);
+
+    return errnum;
+}
+
+    #endif
+
+int portable_get_random_map(unsigned char **bufferptr, size_t size) {
+    if (bufferptr == NULL || size == 0) {
+        return EINVAL;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0) {
+        page_size = 4096;
+    }
+
+    unsigned char *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        return errno;
+    }
+
+    #if defined(PORTABLE_GET_RANDOM_MAP_UFFD)
+    // the range of a mapping always covers whole pages
+    const size_t map_size = (size + page_size - 1) / page_size * page_size;
+    const char *eager = getenv(PORTABLE_GET_RANDOM_MAP_EAGER_ENV);
+
+    if ((eager == NULL || !*eager) && portable_get_random_map_lazy(buffer, map_size, page_size) == 0) {
+        *bufferptr = buffer;
+        return 0;
+    }
+    #endif
+
+    const int errnum = portable_get_random_fill(buffer, size, page_size);
+    if (errnum != 0) {
+        munmap(buffer, size);
+        return errnum;
+    }
+
+    *bufferptr = buffer;
+    return 0;
+}
+
+int portable_get_random_unmap(unsigned char *buffer, size_t size) {
+    #if defined(PORTABLE_GET_RANDOM_MAP_UFFD)
+    PortableGetRandom_LazyMapping *mapping = NULL;
+
+    pthread_mutex_lock(&portable_get_random_lazy_mappings_mutex);
+    PortableGetRandom_LazyMapping **ptr = &portable_get_random_lazy_mappings;
+    while (*ptr != NULL) {
+        if ((*ptr)->buffer == buffer) {
+            mapping = *ptr;
+            *ptr = mapping->next;
+            break;
+        }
+        ptr = &(*ptr)->next;
+    }
+    pthread_mutex_unlock(&portable_get_random_lazy_mappings_mutex);
+
+    if (mapping != NULL) {
+        char byte = 0;
+        while (write(mapping->stop_fds[1], &byte, 1) < 0 && errno == EINTR);
+        pthread_join(mapping->thread, NULL);
+
+        close(mapping->uffd);
+        close(mapping->stop_fds[0]);
+        close(mapping->stop_fds[1]);
+        free(mapping);
+    }
+    #endif
+
+    if (munmap(buffer, size) != 0) {
+        return errno;
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef PORTABLE_GET_RANDOM_SHM_H
+#define PORTABLE_GET_RANDOM_SHM_H
+#pragma once
+
+// Private protocol shared by the shared memory client in portable_get_random.c
+// and the daemon in daemon/portable_get_random_daemon.c. This header is not
+// installed.
+//
+// The daemon fills a ring of random blocks in a shared memory object and hands
+// a read-only file descriptor of it to every client that connects to its Unix
+// socket, together with a file descriptor of a second, small object that only
+// holds head. Clients can't change the blocks other clients will claim, they
+// can only move head. Every block is identified by a sequence number. Block t
+// lives in slot t % block_count and is ready once seqs[slot] == t + 1. Clients
+// claim the block at head by atomically incrementing head, so every block is
+// handed to exactly one client. The daemon only refills a slot once head has
+// moved past the block that was in it, so a client that copied a block that got
+// refilled in the meantime will fail its compare-and-swap and discard the copy.
+
+#include <stdint.h>
+
+#define PORTABLE_GET_RANDOM_SHM_MAGIC       UINT64_C(0x31304d4853524750) // "PGRSHM01"
+#define PORTABLE_GET_RANDOM_SHM_VERSION     2
+#define PORTABLE_GET_RANDOM_SHM_BLOCK_SIZE  256
+#define PORTABLE_GET_RANDOM_SHM_BLOCK_COUNT 4096
+#define PORTABLE_GET_RANDOM_SHM_CACHE_LINE  64
+
+#if !defined(PORTABLE_GET_RANDOM_SOCKET)
+    #define PORTABLE_GET_RANDOM_SOCKET "/tmp/portable-get-random.sock"
+#endif
+
+// overrides PORTABLE_GET_RANDOM_SOCKET at runtime
+#define PORTABLE_GET_RANDOM_SOCKET_ENV "PORTABLE_GET_RANDOM_SOCKET"
+
+// start of the read-only ring, followed by seqs and the blocks
+typedef struct PortableGetRandom_ShmHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t block_count;
+    uint64_t seqs_offset;
+    uint64_t data_offset;
+    unsigned char padding[PORTABLE_GET_RANDOM_SHM_CACHE_LINE - 40];
+} PortableGetRandom_ShmHeader;
+
+// the whole writable object
+typedef struct PortableGetRandom_ShmHead {
+    // next block to be claimed, only accessed atomically
+    uint64_t head;
+    unsigned char padding[PORTABLE_GET_RANDOM_SHM_CACHE_LINE - 8];
+} PortableGetRandom_ShmHead;
+
+#endif // PORTABLE_GET_RANDOM_SHM_H